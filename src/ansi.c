@@ -0,0 +1,118 @@
+#include "ansi.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Return the offset of the first escape character in the length bytes
+ * of string, or length if there is none.
+ *
+ * Most lines have none, so with SSE2 16 bytes are compared at once.
+ */
+int ansi_find(char* string, int length) {
+	char* e = NULL;
+	int i = 0;
+#ifdef __SSE2__
+	__m128i esc = _mm_set1_epi8(ESC);
+	int mask = 0;
+
+	for (; length - i >= 16; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*) (string + i)), esc));
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+
+	e = memchr(string + i, ESC, length - i);
+	return e != NULL ? e - string : length;
+}
+
+/*
+ * Return the length of the escape sequence at the beginning of string.
+ *
+ * CSI sequences end at their final byte and OSC ones at BEL or ST.
+ * A sequence that is cut short ends where it stops making sense,
+ * and never takes the newline.
+ */
+int ansi_length(char* string, int length) {
+	unsigned char* s = (unsigned char*) string;
+	int i = 0;
+
+	if (length < 2) {
+		return length;
+	}
+
+	if (s[1] == '[') {
+		for (i = 2; i < length && s[i] >= 0x20 && s[i] <= 0x3f; i++) {
+		}
+		if (i < length && s[i] >= 0x40 && s[i] <= 0x7e) {
+			i++;
+		}
+		return i;
+	}
+
+	if (s[1] == ']') {
+		for (i = 2; i < length && s[i] != '\n'; i++) {
+			if (s[i] == '\a') {
+				return i + 1;
+			}
+			if (s[i] == ESC && i + 1 < length && s[i + 1] == '\\') {
+				return i + 2;
+			}
+		}
+		return i;
+	}
+
+	return s[1] >= 0x20 && s[1] <= 0x7e ? 2 : 1;
+}
+
+/*
+ * Tell what the length bytes escape sequence at string does to the colors:
+ * SGR_NONE if it is not a SGR sequence, SGR_RESET if it resets them before
+ * setting anything else and SGR_SET if it only sets some more.
+ */
+int ansi_sgr(char* string, int length) {
+	int i = 2;
+
+	if (length < 3 || string[1] != '[' || string[length - 1] != 'm') {
+		return SGR_NONE;
+	}
+
+	/* An empty first parameter is 0 too. */
+	while (string[i] == '0') {
+		i++;
+	}
+
+	return string[i] == ';' || string[i] == 'm' ? SGR_RESET : SGR_SET;
+}
+
+/*
+ * Copy the length bytes of string to visible without the escape
+ * sequences, stopping once limit bytes were copied, and return how many
+ * were. map[i] is set to where visible[i] came from in string, and
+ * map[returned] to where the copy stopped, length if it got to the end.
+ */
+int ansi_strip(char* string, int length, char* visible, int* map, int limit) {
+	int size = 0;
+	int from = 0;
+	int to = 0;
+
+	while (from < length && size < limit) {
+		to = from + ansi_find(string + from, length - from < limit - size ? length - from : limit - size);
+		memcpy(visible + size, string + from, to - from);
+		while (from < to) {
+			map[size++] = from++;
+		}
+
+		if (from < length && size < limit) {
+			from += ansi_length(string + from, length - from);
+		}
+	}
+
+	map[size] = from;
+	return size;
+}
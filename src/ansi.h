@@ -0,0 +1,16 @@
+#ifndef ANSI_H
+#define ANSI_H
+
+#define ESC '\x1b'
+
+/* What an escape sequence does to the colors, see ansi_sgr(). */
+#define SGR_NONE  0
+#define SGR_SET   1
+#define SGR_RESET 2
+
+extern int ansi_find(char* string, int length);
+extern int ansi_length(char* string, int length);
+extern int ansi_sgr(char* string, int length);
+extern int ansi_strip(char* string, int length, char* visible, int* map, int limit);
+
+#endif /* ANSI_H */
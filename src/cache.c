@@ -0,0 +1,148 @@
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* FNV-1a over size bytes of data. */
+unsigned long hash(char* data, int size) {
+	unsigned long h = 2166136261UL;
+
+	while (size-- > 0) {
+		h ^= (unsigned char) *data++;
+		h *= 16777619UL;
+	}
+
+	return h;
+}
+
+/* Hash of key along with the size of the tail that follows it. */
+unsigned long key_hash(char* key, int key_size, int tail) {
+	return (hash(key, key_size) ^ (unsigned long) tail) * 16777619UL;
+}
+
+/* Allocate and return a new cache holding up to capacity lines. */
+cache* cache_new(int capacity) {
+	cache* c = malloc(sizeof(cache));
+	memset(c, 0, sizeof(cache));
+
+	/* Keep the load factor under 1 so chains stay short. */
+	c->buckets_length = 16;
+	while (c->buckets_length < capacity * 2) {
+		c->buckets_length *= 2;
+	}
+
+	c->buckets = malloc(sizeof(cache_entry*) * c->buckets_length);
+	memset(c->buckets, 0, sizeof(cache_entry*) * c->buckets_length);
+	c->capacity = capacity;
+
+	return c;
+}
+
+/* Take e out of the recently used list. */
+void cache_unlink(cache* c, cache_entry* e) {
+	if (e->newer != NULL) {
+		e->newer->older = e->older;
+	} else {
+		c->newest = e->older;
+	}
+
+	if (e->older != NULL) {
+		e->older->newer = e->newer;
+	} else {
+		c->oldest = e->newer;
+	}
+
+	e->newer = NULL;
+	e->older = NULL;
+}
+
+/* Put e at the front of the recently used list. */
+void cache_touch(cache* c, cache_entry* e) {
+	e->older = c->newest;
+	e->newer = NULL;
+
+	if (c->newest != NULL) {
+		c->newest->newer = e;
+	}
+	c->newest = e;
+
+	if (c->oldest == NULL) {
+		c->oldest = e;
+	}
+}
+
+/* Drop the least recently used entry. */
+void cache_evict(cache* c) {
+	cache_entry* e = c->oldest;
+	cache_entry** p = &c->buckets[e->hash & (c->buckets_length - 1)];
+
+	while (*p != e) {
+		p = &(*p)->next;
+	}
+	*p = e->next;
+
+	cache_unlink(c, e);
+	free(e->key);
+	free(e->value);
+	free(e);
+
+	__atomic_sub_fetch(&c->length, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->evictions, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the entry for key followed by tail bytes and mark it as the
+ * most recently used, or NULL if key is not in the cache.
+ */
+cache_entry* cache_get(cache* c, char* key, int key_size, int tail) {
+	unsigned long h = key_hash(key, key_size, tail);
+	cache_entry* e = c->buckets[h & (c->buckets_length - 1)];
+
+	while (e != NULL) {
+		if (e->hash == h && e->key_size == key_size && e->tail == tail && memcmp(e->key, key, key_size) == 0) {
+			cache_unlink(c, e);
+			cache_touch(c, e);
+			__atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+			return e;
+		}
+		e = e->next;
+	}
+
+	__atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/*
+ * Copy key, followed by tail bytes, and value into the cache, evicting
+ * the least recently used entry if it is full. key must not be in the
+ * cache already.
+ */
+void cache_put(cache* c, char* key, int key_size, int tail, char* value, int value_size) {
+	cache_entry* e = NULL;
+	int i = 0;
+
+	if (c->capacity < 1) {
+		return;
+	}
+
+	if (c->length >= c->capacity) {
+		cache_evict(c);
+	}
+
+	e = malloc(sizeof(cache_entry));
+	e->hash = key_hash(key, key_size, tail);
+	e->key = malloc(key_size);
+	memcpy(e->key, key, key_size);
+	e->key_size = key_size;
+	e->tail = tail;
+	e->value = malloc(value_size);
+	memcpy(e->value, value, value_size);
+	e->value_size = value_size;
+
+	i = e->hash & (c->buckets_length - 1);
+	e->next = c->buckets[i];
+	c->buckets[i] = e;
+
+	cache_touch(c, e);
+	__atomic_add_fetch(&c->length, 1, __ATOMIC_RELAXED);
+}
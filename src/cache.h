@@ -0,0 +1,39 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+/* One cached line along with its rendered output. */
+typedef struct cache_entry_ {
+	unsigned long hash;
+	char* key;
+	int key_size;
+	int tail;                   /* bytes of the line past the key */
+	char* value;
+	int value_size;
+	struct cache_entry_* next;  /* next entry in the same bucket */
+	struct cache_entry_* newer; /* towards the most recently used */
+	struct cache_entry_* older; /* towards the least recently used */
+} cache_entry;
+
+/*
+ * Bounded LRU cache from lines to their rendered output. With a scan
+ * window only the part of the line patterns look at is a key, along with
+ * how much of the line follows it, which is copied out as is.
+ */
+typedef struct {
+	cache_entry** buckets;
+	int buckets_length;
+	int length;
+	int capacity;
+	cache_entry* newest;
+	cache_entry* oldest;
+	/* Counters below, and length, are updated atomically for -s. */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+} cache;
+
+extern cache* cache_new(int capacity);
+extern cache_entry* cache_get(cache* c, char* key, int key_size, int tail);
+extern void cache_put(cache* c, char* key, int key_size, int tail, char* value, int value_size);
+
+#endif /* CACHE_H */
@@ -0,0 +1,231 @@
+#define _XOPEN_SOURCE 600
+
+#include "decompress.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Tell the format of file by its first bytes, without reading past them,
+ * so a plain file can still be read from the beginning.
+ */
+int format(FILE* file) {
+	unsigned char magic[4];
+
+	if (pread(fileno(file), magic, 4, 0) != 4) {
+		return FORMAT_PLAIN;
+	}
+
+	if (magic[0] == 0x1f && magic[1] == 0x8b) {
+		return FORMAT_GZIP;
+	}
+
+	if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+		return FORMAT_ZSTD;
+	}
+
+	return FORMAT_PLAIN;
+}
+
+/* Write all size bytes of data to fd. */
+void write_all(int fd, char* data, int size) {
+	int n = 0;
+
+	while (size > 0) {
+		n = write(fd, data, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			printf("Could not decompress file: %s\n", strerror(errno));
+			exit(1);
+		}
+		data += n;
+		size -= n;
+	}
+}
+
+/*
+ * Inflate gzip data from s->in into s->out. Files made of several gzip
+ * members, like concatenated ones, are inflated one after the other,
+ * and anything after the last one that is not a gzip member is ignored.
+ */
+void inflate_gzip(stream* s) {
+	char* in = malloc(CHUNK_SIZE);
+	char* out = malloc(CHUNK_SIZE);
+	z_stream z;
+	int r = Z_OK;
+	int full = 0;
+	int ended = 0;
+
+	memset(&z, 0, sizeof(z_stream));
+	if (inflateInit2(&z, 15 + 16) != Z_OK) {
+		printf("Could not decompress file: %s\n", z.msg);
+		exit(1);
+	}
+
+	while (1) {
+		/* Only read on once everything inflated so far was taken out. */
+		if (z.avail_in == 0 && !full) {
+			z.next_in = (unsigned char*) in;
+			z.avail_in = fread(in, 1, CHUNK_SIZE, s->in);
+			if (z.avail_in == 0) {
+				break;
+			}
+		}
+
+		/*
+		 * Like gzip, take what follows the last member without the gzip
+		 * magic, like zeros padding the file, as the end of the file.
+		 */
+		if (ended && z.total_in == 0 && z.avail_in > 0 &&
+			(z.next_in[0] != 0x1f || (z.avail_in > 1 && z.next_in[1] != 0x8b))) {
+			break;
+		}
+
+		z.next_out = (unsigned char*) out;
+		z.avail_out = CHUNK_SIZE;
+		r = inflate(&z, Z_NO_FLUSH);
+		if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+			printf("Could not decompress file: %s\n", z.msg != NULL ? z.msg : "corrupt data");
+			exit(1);
+		}
+		write_all(s->out, out, CHUNK_SIZE - z.avail_out);
+		full = z.avail_out == 0;
+
+		/* A new member is under way as soon as any of it is read. */
+		if (r == Z_STREAM_END) {
+			ended = 1;
+			inflateReset(&z);
+		} else if (z.total_in > 0) {
+			ended = 0;
+		}
+	}
+
+	if (!ended) {
+		printf("Could not decompress file: unexpected end of file\n");
+		exit(1);
+	}
+
+	inflateEnd(&z);
+	free(in);
+	free(out);
+}
+
+#ifdef WITH_ZSTD
+/* Decompress zstd data from s->in into s->out. */
+void inflate_zstd(stream* s) {
+	char* in = malloc(CHUNK_SIZE);
+	char* out = malloc(CHUNK_SIZE);
+	ZSTD_DStream* z = ZSTD_createDStream();
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	size_t r = 1;
+
+	ZSTD_initDStream(z);
+	zout.dst = out;
+	zout.size = CHUNK_SIZE;
+	zin.src = in;
+
+	while ((zin.size = fread(in, 1, CHUNK_SIZE, s->in)) > 0) {
+		zin.pos = 0;
+
+		/* A full output buffer means there may be more to take out. */
+		do {
+			zout.pos = 0;
+			r = ZSTD_decompressStream(z, &zout, &zin);
+			if (ZSTD_isError(r)) {
+				printf("Could not decompress file: %s\n", ZSTD_getErrorName(r));
+				exit(1);
+			}
+			write_all(s->out, out, zout.pos);
+		} while (zin.pos < zin.size || zout.pos == zout.size);
+	}
+
+	/* Anything but 0 means the last frame is not over. */
+	if (r != 0) {
+		printf("Could not decompress file: unexpected end of file\n");
+		exit(1);
+	}
+
+	ZSTD_freeDStream(z);
+	free(in);
+	free(out);
+}
+#endif
+
+/* Decompress a stream until its end and close the pipe behind it. */
+void* run_stream(void* arg) {
+	stream* s = arg;
+
+	if (s->format == FORMAT_GZIP) {
+		inflate_gzip(s);
+	}
+#ifdef WITH_ZSTD
+	if (s->format == FORMAT_ZSTD) {
+		inflate_zstd(s);
+	}
+#endif
+
+	fclose(s->in);
+	close(s->out);
+	free(s);
+	return NULL;
+}
+
+/*
+ * Return file itself if it is not compressed. Otherwise return the end
+ * of a pipe it is decompressed into, as it is read, by a thread of its
+ * own, so decompressing overlaps with matching. In line mode, with or
+ * without -p, the whole decompressed file never has to be in memory at
+ * once. Char mode still reads it whole, see readfile(), since its
+ * patterns run over the whole text.
+ */
+FILE* decompress(FILE* file) {
+	stream* s = NULL;
+	pthread_t thread;
+	sigset_t all;
+	sigset_t old;
+	int fds[2];
+	int f = format(file);
+
+	if (f == FORMAT_PLAIN) {
+		return file;
+	}
+
+#ifndef WITH_ZSTD
+	if (f == FORMAT_ZSTD) {
+		printf("Could not read file: zstd support was not built in.\n");
+		exit(1);
+	}
+#endif
+
+	if (pipe(fds) != 0) {
+		printf("Could not decompress file: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	s = malloc(sizeof(stream));
+	s->in = file;
+	s->out = fds[1];
+	s->format = f;
+
+	/* Signals are left to the other threads, like SIGUSR1 to -s. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_create(&thread, NULL, run_stream, s);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_detach(thread);
+
+	return fdopen(fds[0], "rb");
+}
@@ -0,0 +1,23 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stdio.h>
+
+/* Formats compressed input is recognized in by its first bytes. */
+#define FORMAT_PLAIN 0
+#define FORMAT_GZIP  1
+#define FORMAT_ZSTD  2
+
+/* How many bytes are read from or written to the pipe at once. */
+#define CHUNK_SIZE 65536
+
+/* A compressed file being decompressed into a pipe. */
+typedef struct {
+	FILE* in;
+	int out;    /* the end of the pipe written to */
+	int format;
+} stream;
+
+extern FILE* decompress(FILE* file);
+
+#endif /* DECOMPRESS_H */
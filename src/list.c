@@ -47,6 +47,25 @@ int list_add(list* l, void* e) {
 	return 0;
 }
 
+/* Free the list along with every element in it. */
+void list_free(list* l) {
+	list_node* n = l->head->next;
+	list_node* next = NULL;
+
+	while (n != NULL) {
+		next = n->next;
+		free(n->element);
+		free(n);
+		n = next;
+	}
+
+	if (l->length < 1) {
+		free(l->tail);
+	}
+	free(l->head);
+	free(l);
+}
+
 /* Print the list for debugging purposes. */
 void list_print(list* l) {
 	list_node* n = l->head;
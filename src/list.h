@@ -15,6 +15,7 @@ typedef struct {
 extern list_node* list_node_new(void* e);
 extern list* list_new();
 extern int list_add(list* l, void* e);
+extern void list_free(list* l);
 extern void list_print(list* l);
 
 #endif /* LIST_H */
@@ -1,17 +1,26 @@
 #include "options.h"
 #include "scanner.h"
+#include "stats.h"
+#include "pipeline.h"
 
 int main(int argc, char* argv[]) {
 	options* opt;
 
 	opt = parse_options(argc, argv);
 
+	if (opt->stats) {
+		stats_enable(opt);
+	}
+
 	switch (opt->mode) {
 		case MODE_CHAR:
-			return scanchar(opt->string, opt->string_size, opt->code, opt->colors);
+			return scanchar(opt->string, opt->string_size, opt->code, opt->owners, opt->colors, opt->utf8);
 			break;
 		case MODE_LINE:
-			return scanline(opt->file, opt->patterns, opt->colors);
+			if (opt->depth > 0) {
+				return pipeline(opt);
+			}
+			return scanline(opt);
 			break;
 	}
 
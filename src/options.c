@@ -1,6 +1,9 @@
 #include "list.h"
 #include "options.h"
 #include "colors.h"
+#include "utf8.h"
+#include "scanner.h"
+#include "decompress.h"
 
 #include <getopt.h>
 #include <stdio.h>
@@ -13,7 +16,7 @@ void help() {
 	/* Usage*/
 	printf(
 "Usage:\n"
-"    color [-h] [-f <filename>] [-c <foreground[/<background>]>...] <pattern...>\n"
+"    color [-h] [-s] [-u] [-g] [-d <delimiter>] [-F <fields>] [-k <lines>] [-l <limit>] [-r <limit>] [-t <usec>] [-w <bytes>] [-p <depth>] [-b] [-a] [-f <filename>] [-c <foreground[/<background>]>...] <pattern...>\n"
 "\n");
 
 	/* Description */
@@ -29,7 +32,7 @@ void help() {
 "    -h\n"
 "        Print this message and exit.\n"
 "    -f <filename>\n"
-"        Read <filename> instead of stdin.\n"
+"        Read <filename> instead of stdin. Files compressed with gzip, or zstd if built with ZSTD=1, are decompressed as they are read.\n"
 "    -c <foreground>[/<background>]\n"
 "        Specify the foreground and background colors. Background is optional. See Supported colors and Examples for more information.\n"
 		);
@@ -39,6 +42,50 @@ void help() {
 "        Line mode executes every pattern line by line.\n"
 "        Char mode advances the text from left to right executing every pattern each character.\n"
 "        Nested matches are NOT supported by any of the two modes. They will be ignored. First matches have priority.\n"
+"        In line mode, once earlier patterns have colored a whole line, later ones are not run on it, so they can't color its newline.\n"
+		);
+	printf(
+"    -s\n"
+"        Print per-line latency and per-pattern hit rate statistics to stderr at exit or when receiving SIGUSR1. Line mode only.\n"
+"        Every line is flushed as soon as it is written so the time blocked on output can be measured.\n"
+"    -k <lines>\n"
+"        Remember the colored output of the last <lines> distinct lines, so repeated lines are written out without running any pattern. Line mode only.\n"
+		);
+	printf(
+"    -u\n"
+"        Match characters instead of bytes, treating the input as UTF-8. Lines that are not valid UTF-8 are still matched byte by byte.\n"
+"    -g\n"
+"        Color each capture group of a pattern on its own, the first group taking the next color, the second the one after and so on. Patterns without groups take a single color. Line mode only.\n"
+"    -p <depth>\n"
+"        Read, match and write on three separate threads, with up to <depth> batches of lines queued between each of them. Line mode only.\n"
+		);
+	printf(
+"    -b\n"
+"        Run each pattern over a whole batch of lines at once first, so it is only run line by line where it may match. Implies -p 1 if no -p is given.\n"
+"        With -t, each run over a batch gets the time of a single line, and lines it didn't get to are left to run on their own.\n"
+		);
+	printf(
+"    -a\n"
+"        Keep the colors already in the input. Patterns only see the text between its escape sequences, which are written out where they were.\n"
+"        Colors the input leaves set carry over to the next lines, which are then not cached with -k. Line mode only.\n"
+		);
+	printf(
+"    -l <limit>\n"
+"    -r <limit>\n"
+"        Set PCRE's match limit or recursion limit. A line a pattern runs out of them on is written out uncolored. Line mode only.\n"
+		);
+	printf(
+"    -t <usec>\n"
+"        Write a line out uncolored if the patterns spent more than <usec> microseconds on it. A pattern still running by then is stopped.\n"
+"        Patterns check the time as they run, which makes them somewhat slower. Line mode only.\n"
+"    -w <bytes>\n"
+"        Only look for patterns in the first <bytes> bytes of each line, not counting its newline, and copy the rest as is. With -k and -a, lines are only cached and stripped of escape sequences that far too. Line mode only.\n"
+		);
+	printf(
+"    -d <delimiter>\n"
+"    -F <field>[,<field>...]\n"
+"        Restrict patterns to fields of lines split by <delimiter>, a single ASCII character or \\t for tab, which is the default.\n"
+"        Fields are matched to patterns by order of declaration and counted from 1, up to 1024. Field 0, or no field, is the whole line. Line mode only.\n"
 "\n");
 
 	/* Supported colors */
@@ -84,6 +131,7 @@ void help() {
 /* Allocate and return a new pattern. */
 pattern* new_pattern(char* string, pcre* code) {
 	pattern* p = malloc(sizeof(pattern));
+	memset(p, 0, sizeof(pattern));
 	p->string = string;
 	p->code = code;
 	return p;
@@ -91,6 +139,7 @@ pattern* new_pattern(char* string, pcre* code) {
 
 /*
  * Return a pointer to filename if it's valid. Return stdin otherwise.
+ * Compressed files are decompressed on the fly, see decompress().
  */
 FILE* selectfile(char* filename) {
 	FILE* file = stdin;
@@ -101,13 +150,15 @@ FILE* selectfile(char* filename) {
 			printf("Could not open file: %s\n", filename);
 			exit(1);
 		}
+		file = decompress(file);
 	}
 
 	return file;
 }
 
 /*
- * Read filename if it's a valid readable filename. Read stdin otherwise.
+ * Read file whole, at once if it can be seeked and as it comes otherwise,
+ * like when it is stdin or being decompressed.
  * Returns a pointer to a buffer containing all the contents of the read file.
  */
 char* readfile(FILE* file, int* string_size) {
@@ -118,12 +169,12 @@ char* readfile(FILE* file, int* string_size) {
 	int c = 0;
 	unsigned int size = 1024 * sizeof(char);
 
-	if (file != stdin) {
+	if (fseek(file, 0, SEEK_END) == 0) {
 		fsize = ftell(file);
 		rewind(file);
-		buffer = malloc(sizeof(char) * size + 1);
-		memset(buffer, 0, size + 1);
-		fread(buffer, fsize, sizeof(char), file);
+		buffer = malloc(sizeof(char) * fsize + 1);
+		memset(buffer, 0, fsize + 1);
+		fread(buffer, sizeof(char), fsize, file);
 		*string_size = fsize;
 
 		return buffer;
@@ -137,7 +188,7 @@ char* readfile(FILE* file, int* string_size) {
 		if ((buffer - bufferp) == size) {
 			size = size*2;
 			tmp = malloc(size);
-			strcpy(tmp, bufferp);
+			memcpy(tmp, bufferp, size/2);
 			free(bufferp);
 			buffer = tmp + (size/2);
 			bufferp = tmp;
@@ -146,14 +197,13 @@ char* readfile(FILE* file, int* string_size) {
 		*buffer++ = c;
 	}
 
-	*string_size = strlen(bufferp);
+	*string_size = buffer - bufferp;
 	return bufferp;
 }
 
 /* Just a wrapper to pcre_compile. */
-pcre* compile_pcre(char* pattern) {
+pcre* compile_pcre(char* pattern, int options) {
 	pcre* code = NULL;
-	int options = 0;
 	const char* errptr = NULL;
 	int* erroffset = malloc(sizeof(int));
 	unsigned char *tableptr = NULL;
@@ -170,36 +220,202 @@ pcre* compile_pcre(char* pattern) {
 	return code;
 }
 
+/*
+ * Return 1 if pattern matches the same inside a block of lines as it
+ * does on each line alone, as far as finding which lines it may match.
+ *
+ * That is not the case for anything that looks at the end of the
+ * subject, or at what is before or after the match, since in a block
+ * that is another line. This errs on the safe side, like rejecting a $
+ * inside a character class too.
+ */
+int block_safe(char* pattern) {
+	char* s = NULL;
+
+	for (s = pattern; *s != '\0'; s++) {
+		if (*s == '$') {
+			return 0;
+		}
+
+		if (*s == '\\' && s[1] != '\0') {
+			if (strchr("AzZGBK", *++s) != NULL) {
+				return 0;
+			}
+			continue;
+		}
+
+		/* Only plain and named groups, no assertions, options or verbs. */
+		if (*s == '(' && s[1] == '*') {
+			return 0;
+		}
+		if (*s == '(' && s[1] == '?' && s[2] != ':' &&
+			!(s[2] == 'P' && s[3] == '<') && !(s[2] == '<' && s[3] != '=' && s[3] != '!')) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
 /*
  * Compile each pattern from the list of patterns
  * and return a new list, containing the compiled ones.
+ *
+ * In UTF-8 mode every pattern is compiled twice: for valid UTF-8 lines
+ * and for the lines that have to be matched byte by byte.
+ *
+ * If groups is set, each capture group of a pattern is a target of its
+ * own, otherwise the whole pattern is. targets_length is set to how
+ * many targets there are, which is how many colors are needed.
+ *
+ * Every pattern is matched with the limits in extra, which may be NULL.
+ * If timed is set, the patterns are compiled with PCRE_AUTO_CALLOUT so
+ * the time budget can be checked while they run, see past_deadline().
+ *
+ * If block is set, patterns that can be are compiled once more
+ * to be run over a block of lines, see scanblock().
  */
-list* build_patterns(list* patterns) {
+list* build_patterns(list* patterns, int utf8, int groups, int block, int timed, pcre_extra* extra, int* targets_length) {
 	list* result = list_new();
 	list_node* n = patterns->head;
-	pcre* code = NULL;
+	pattern* p = NULL;
+	int flags = timed ? PCRE_AUTO_CALLOUT : 0;
 
+	*targets_length = 0;
 	while ((n = n->next) != NULL) {
-		code = compile_pcre(n->element);
-		list_add(result, new_pattern(n->element, code));
+		p = new_pattern(n->element, compile_pcre(n->element, flags));
+		if (utf8) {
+			p->utf8_code = compile_pcre(n->element, flags | PCRE_UTF8);
+		}
+
+		if (block && block_safe(n->element)) {
+			p->block_code = compile_pcre(n->element, flags | PCRE_MULTILINE);
+			if (utf8) {
+				p->block_utf8_code = compile_pcre(n->element, flags | PCRE_MULTILINE | PCRE_UTF8);
+			}
+		}
+
+		p->extra = extra;
+		p->ovecsize = ovector_size(p->code);
+		if (groups) {
+			p->groups = p->ovecsize / 3 - 1;
+		}
+
+		p->color = *targets_length;
+		*targets_length += p->groups > 0 ? p->groups : 1;
+		list_add(result, p);
 	}
 
 	return result;
 }
 
+/*
+ * Parse a comma separated list of field numbers into a list,
+ * 0 meaning the whole line and MAX_FIELD being the highest.
+ */
+list* parse_fields(char* string) {
+	list* fields = list_new();
+	char* end = NULL;
+	long* field = NULL;
+
+	while (1) {
+		field = malloc(sizeof(long));
+		*field = strtol(string, &end, 10);
+		if (end == string || *field < 0 || *field > MAX_FIELD || (*end != ',' && *end != '\0')) {
+			printf("%s is not a valid list of fields. Use -h if you need help.\n", string);
+			exit(1);
+		}
+		list_add(fields, field);
+
+		if (*end == '\0') {
+			break;
+		}
+		string = end + 1;
+	}
+
+	return fields;
+}
+
+/*
+ * Restrict the patterns to the fields, by order of declaration.
+ * Patterns past the end of fields keep looking at the whole line.
+ * Returns the highest field any pattern is restricted to.
+ */
+int assign_fields(list* patterns, list* fields) {
+	list_node* n = patterns->head;
+	list_node* f = fields->head;
+	pattern* p = NULL;
+	int highest = 0;
+
+	while ((n = n->next) != NULL && (f = f->next) != NULL) {
+		p = n->element;
+		p->field = *(long*) f->element;
+		if (p->field > highest) {
+			highest = p->field;
+		}
+	}
+
+	return highest;
+}
+
+/*
+ * Return the pcre_extra setting the match limits, or NULL if there are none.
+ * A limit of 0 means to keep PCRE's default.
+ *
+ * If timed is set, it also takes callout data, which is where each line
+ * puts its deadline, see matchline().
+ */
+pcre_extra* new_extra(unsigned long match_limit, unsigned long recursion_limit, int timed) {
+	pcre_extra* extra = NULL;
+
+	if (match_limit == 0 && recursion_limit == 0 && !timed) {
+		return NULL;
+	}
+
+	extra = malloc(sizeof(pcre_extra));
+	memset(extra, 0, sizeof(pcre_extra));
+
+	if (match_limit > 0) {
+		extra->flags |= PCRE_EXTRA_MATCH_LIMIT;
+		extra->match_limit = match_limit;
+	}
+
+	if (recursion_limit > 0) {
+		extra->flags |= PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+		extra->match_limit_recursion = recursion_limit;
+	}
+
+	if (timed) {
+		extra->flags |= PCRE_EXTRA_CALLOUT_DATA;
+	}
+
+	return extra;
+}
+
 /*
  * Concatenate every pattern from the patterns list
- * into one regular expression and compile it.
+ * into one regular expression and compile it with options.
+ *
+ * Each pattern is wrapped in a group of its own. owners is set to an
+ * array in the form (group) => (index of pattern), -1 for groups that
+ * belong to a pattern instead of wrapping one, since those shift the
+ * numbers of the groups wrapping the patterns after it.
  */
-pcre* concatenate(list* patterns) {
+pcre* concatenate(list* patterns, int options, int** owners) {
 	char* pattern = malloc(1);
 	char* string = NULL;
 	char* tmp = NULL;
 	list_node* n = patterns->head;
 	unsigned int size = 0;
+	int* groups = malloc(sizeof(int) * patterns->length);
+	int total = 0;
+	int i = 0;
+	int j = 0;
 	memset(pattern, 0, 1);
 	while ((n = n->next) != NULL) {
 		string = n->element;
+		groups[i++] = ovector_size(compile_pcre(string, options)) / 3;
+		total += groups[i - 1];
 		size += strlen(string) + 3;
 		tmp = malloc(sizeof(char) * size + 1);
 		strcpy(tmp, pattern);
@@ -213,7 +429,15 @@ pcre* concatenate(list* patterns) {
 	/* Remove the trailing pipe. */
 	pattern[size-1] = '\0';
 
-	return compile_pcre(pattern);
+	/* Pattern i is wrapped by the group after those of the patterns before it. */
+	*owners = malloc(sizeof(int) * (total + 1));
+	memset(*owners, -1, sizeof(int) * (total + 1));
+	for (i = 0, j = 1; i < patterns->length; j += groups[i++]) {
+		(*owners)[j] = i;
+	}
+	free(groups);
+
+	return compile_pcre(pattern, options);
 }
 
 /*
@@ -221,6 +445,7 @@ pcre* concatenate(list* patterns) {
  */
 options* new_options() {
 	options* opt = malloc(sizeof(options));
+	memset(opt, 0, sizeof(options));
 	return opt;
 }
 
@@ -266,9 +491,23 @@ options* parse_options(int argc, char* argv[]) {
 	options* opt = new_options();
 	int option, c, i;
 	int mode = MODE_LINE;
+	int stats = 0;
+	int cache_size = 0;
+	int depth = 0;
+	int block = 0;
+	int ansi = 0;
+	int utf8 = 0;
+	int groups = 0;
+	int targets_length = 0;
+	long match_limit = 0;
+	long recursion_limit = 0;
+	long budget = 0;
+	char delimiter = '\t';
+	long window = 0;
+	list* fields = NULL;
 	FILE* file;
 
-    while ((option = getopt(argc, argv, "hc:f:m:")) != -1) {
+    while ((option = getopt(argc, argv, "hsugbac:d:f:F:k:l:m:p:r:t:w:")) != -1) {
         switch (option) {
 			/* Add a color to the list of colors. */
 			case 'c' :
@@ -311,6 +550,38 @@ options* parse_options(int argc, char* argv[]) {
 			case 'f':
 				filename = optarg;
 				break;
+			case 'd':
+				if (strcmp(optarg, "\\t") == 0) {
+					delimiter = '\t';
+				} else if (strlen(optarg) == 1 && optarg[0] != '\n' && (unsigned char) optarg[0] < 0x80) {
+					delimiter = optarg[0];
+				} else {
+					printf("%s is not a valid delimiter. Use -h if you need help.\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'F':
+				fields = parse_fields(optarg);
+				break;
+			case 'g':
+				groups = 1;
+				break;
+			case 'b':
+				block = 1;
+				break;
+			case 'a':
+				ansi = 1;
+				break;
+			case 'u':
+				utf8 = 1;
+				break;
+			case 'k':
+				cache_size = atoi(optarg);
+				if (cache_size < 1) {
+					printf("%s is not a valid cache size. Use -h if you need help.\n", optarg);
+					exit(1);
+				}
+				break;
 			case 'm':
 				if (strcmp(optarg, "line") == 0) {
 					mode = MODE_LINE;
@@ -321,6 +592,44 @@ options* parse_options(int argc, char* argv[]) {
 					exit(1);
 				}
 				break;
+			case 's':
+				stats = 1;
+				break;
+			case 'l':
+				match_limit = atol(optarg);
+				if (match_limit < 1) {
+					printf("%s is not a valid match limit. Use -h if you need help.\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'r':
+				recursion_limit = atol(optarg);
+				if (recursion_limit < 1) {
+					printf("%s is not a valid recursion limit. Use -h if you need help.\n", optarg);
+					exit(1);
+				}
+				break;
+			case 't':
+				budget = atol(optarg);
+				if (budget < 1) {
+					printf("%s is not a valid time budget. Use -h if you need help.\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'w':
+				window = atol(optarg);
+				if (window < 1) {
+					printf("%s is not a valid scan window. Use -h if you need help.\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'p':
+				depth = atoi(optarg);
+				if (depth < 1) {
+					printf("%s is not a valid queue depth. Use -h if you need help.\n", optarg);
+					exit(1);
+				}
+				break;
 			case 'h':
 			default:
 				/* Print the help message and exit. */
@@ -349,14 +658,40 @@ options* parse_options(int argc, char* argv[]) {
 
 	/* Build the opt stuff. */
 	opt->mode = mode;
+	opt->stats = stats;
+	opt->depth = depth;
 	opt->file = file;
 	if (opt->mode == MODE_CHAR) {
 		opt->string = readfile(file, &opt->string_size);
-		opt->code = concatenate(patterns);
+
+		/* Input that is not valid UTF-8 is matched byte by byte. */
+		opt->utf8 = utf8 && utf8_valid(opt->string, opt->string_size);
+		opt->code = concatenate(patterns, opt->utf8 ? PCRE_UTF8 : 0, &opt->owners);
+		targets_length = patterns->length;
 	} else {
-		opt->patterns = build_patterns(patterns);
+		opt->utf8 = utf8;
+		opt->groups = groups;
+		opt->block = block;
+		opt->ansi = ansi;
+		if (block && depth == 0) {
+			opt->depth = 1;
+		}
+		opt->budget = budget * 1000;
+		opt->window = window;
+		opt->patterns = build_patterns(patterns, utf8, groups, block, budget > 0,
+			new_extra(match_limit, recursion_limit, budget > 0), &targets_length);
+		if (budget > 0) {
+			pcre_callout = past_deadline;
+		}
+		if (fields != NULL) {
+			opt->delimiter = delimiter;
+			opt->fields = assign_fields(opt->patterns, fields);
+		}
+		if (cache_size > 0) {
+			opt->cache = cache_new(cache_size);
+		}
 	}
-	opt->colors = organize(colors, patterns->length);
+	opt->colors = organize(colors, targets_length);
 
 	return opt;
 }
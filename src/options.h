@@ -3,6 +3,7 @@
 
 #include "list.h"
 #include "colors.h"
+#include "cache.h"
 
 #include <pcre.h>
 #include <stdio.h>
@@ -10,9 +11,27 @@
 #define MODE_LINE 0
 #define MODE_CHAR 1
 
+/* Highest field a pattern can be restricted to. */
+#define MAX_FIELD 1024
+
 typedef struct {
 	char* string;
 	pcre* code;
+	pcre* utf8_code;        /* only in UTF-8 mode */
+	pcre* block_code;       /* multiline versions for -b, NULL if the pattern */
+	pcre* block_utf8_code;  /* can't be run over a block of lines */
+	pcre_extra* extra;      /* match limits for both codes, may be NULL */
+	int ovecsize;           /* room needed for the match and all its groups */
+	int groups;             /* capture groups colored on their own, if any */
+	int color;              /* index of the color of the match or its first group */
+	int field;              /* field the pattern is restricted to, 0 for the whole line */
+	/* Counters below are updated atomically, -s reads them from another thread. */
+	unsigned long lines;    /* lines the pattern ran on */
+	unsigned long hits;     /* lines where it colored something */
+	unsigned long skips;    /* lines already fully colored by earlier patterns */
+	unsigned long limits;   /* lines left uncolored by running out of match limits */
+	unsigned long timeouts; /* lines left uncolored by running out of time */
+	unsigned long time;     /* nanoseconds spent matching, only with -s */
 } pattern;
 
 typedef struct {
@@ -21,8 +40,20 @@ typedef struct {
 	int string_size;
 	list* patterns;
 	pcre* code;
+	int* owners;          /* pattern each group of code wraps, char mode only */
 	color** colors;
 	int mode;
+	int stats;
+	int depth;
+	int block;
+	int ansi;             /* keep the escape sequences already in the input */
+	int utf8;
+	int groups;
+	unsigned long budget; /* nanoseconds patterns may spend on a line, 0 for no limit */
+	char delimiter;       /* what separates fields */
+	int fields;           /* highest field any pattern is restricted to */
+	unsigned int window;  /* bytes of each line patterns look at, 0 for all */
+	cache* cache;
 } options;
 
 extern options* parse_options(int argc, char* argv[]);
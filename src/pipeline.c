@@ -0,0 +1,261 @@
+#define _XOPEN_SOURCE 600
+
+#include "pipeline.h"
+#include "scanner.h"
+#include "stats.h"
+#include "ring.h"
+#include "utf8.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Allocate and return a new empty batch. */
+batch* batch_new(int timed) {
+	batch* b = malloc(sizeof(batch));
+	memset(b, 0, sizeof(batch));
+	b->capacity = READ_SIZE * 2;
+	b->data = malloc(b->capacity);
+	b->out = o_buffer_new();
+	if (timed) {
+		b->stamps = malloc(sizeof(unsigned long) * STAMPS * BATCH_LINES);
+	}
+	return b;
+}
+
+/* Free b and everything it holds. */
+void batch_free(batch* b) {
+	free(b->data);
+	free(b->out->data);
+	free(b->out);
+	free(b->stamps);
+	free(b);
+}
+
+/* Make sure b can take size more bytes. */
+void batch_reserve(batch* b, int size) {
+	while (b->capacity - b->size < size) {
+		b->capacity *= 2;
+		b->data = realloc(b->data, b->capacity);
+	}
+}
+
+/* End the next line of b at offset end. */
+void batch_line(stages* st, batch* b, int end, unsigned long* wait) {
+	if (st->timed) {
+		b->stamps[b->count * STAMPS + STAMP_WAIT] = *wait;
+		b->stamps[b->count * STAMPS + STAMP_READ] = stats_clock();
+		*wait = 0;
+	}
+
+	b->ends[b->count++] = end;
+}
+
+/*
+ * Read fd in blocks and split it into batches of lines for the matcher.
+ *
+ * A batch is handed over as soon as it is full or when a read comes back
+ * short, meaning nothing else is waiting to be read and the next read
+ * might block, so lines never sit in the reader while it waits for more.
+ */
+void read_batches(stages* st, int fd) {
+	batch* b = ring_pop(st->empty);
+	batch* next = NULL;
+	char* nl = NULL;
+	int scanned = 0;
+	int last = 0;
+	int n = 0;
+	int eof = 0;
+	int drained = 0;
+	unsigned long wait = 0;
+	unsigned long t = 0;
+
+	b->size = 0;
+	b->count = 0;
+
+	while (1) {
+		/* Split every complete line read so far. */
+		while (b->count < BATCH_LINES && (nl = memchr(b->data + scanned, '\n', b->size - scanned)) != NULL) {
+			scanned = nl - b->data + 1;
+			batch_line(st, b, scanned, &wait);
+		}
+
+		/* The last line may not end in a newline. */
+		if (eof && b->count < BATCH_LINES && scanned < b->size) {
+			scanned = b->size;
+			batch_line(st, b, scanned, &wait);
+		}
+
+		if (b->count == BATCH_LINES || ((drained || eof) && b->count > 0)) {
+			/* Carry whatever follows the last line over to the next batch. */
+			last = b->ends[b->count - 1];
+			next = ring_pop(st->empty);
+			next->size = 0;
+			next->count = 0;
+			batch_reserve(next, b->size - last);
+			memcpy(next->data, b->data + last, b->size - last);
+			next->size = b->size - last;
+			b->size = last;
+
+			ring_push(st->full, b);
+			b = next;
+			scanned = 0;
+			continue;
+		}
+
+		if (eof) {
+			break;
+		}
+
+		batch_reserve(b, READ_SIZE);
+		if (st->timed) {
+			t = stats_clock();
+		}
+
+		n = read(fd, b->data + b->size, READ_SIZE);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (st->timed) {
+			wait += stats_clock() - t;
+		}
+
+		if (n <= 0) {
+			eof = 1;
+			continue;
+		}
+
+		b->size += n;
+		drained = n < READ_SIZE;
+	}
+
+	/*
+	 * Nothing takes batches from empty anymore, and the writer may still
+	 * be giving some back, so this one can't go there.
+	 */
+	batch_free(b);
+	ring_push(st->full, NULL);
+}
+
+/*
+ * Color every batch coming from the reader and pass it on to the writer.
+ *
+ * In UTF-8 mode the whole batch is validated at once. Only if that
+ * fails does every line get validated on its own.
+ *
+ * With -b, patterns are first run over the whole batch to rule out the
+ * lines they can't match.
+ *
+ * With -a, the colors set by the input carry over from one line to the
+ * next, across batches too, see colorline().
+ */
+void* match_batches(void* arg) {
+	stages* st = arg;
+	batch* b = NULL;
+	unsigned long* stamps = NULL;
+	char* absent = NULL;
+	int patterns = st->opt->patterns->length;
+	o_buffer* state = st->opt->ansi ? o_buffer_new() : NULL;
+	int valid = 0;
+	int from = 0;
+	int i = 0;
+
+	while ((b = ring_pop(st->full)) != NULL) {
+		b->out->size = 0;
+		from = 0;
+		valid = st->opt->utf8 && utf8_valid(b->data, b->size);
+		if (st->opt->block) {
+			absent = scanblock(b->data, b->ends, b->count, st->opt, valid);
+		}
+
+		for (i = 0; i < b->count; i++) {
+			stamps = st->timed ? b->stamps + i * STAMPS : NULL;
+			colorline(b->out, b->data + from, b->ends[i] - from, st->opt, valid,
+				absent != NULL ? absent + i * patterns : NULL, state, stamps != NULL ? &stamps[STAMP_MATCHED] : NULL);
+			if (stamps != NULL) {
+				stamps[STAMP_RENDERED] = stats_clock();
+			}
+			from = b->ends[i];
+		}
+
+		free(absent);
+		absent = NULL;
+
+		ring_push(st->colored, b);
+	}
+
+	ring_push(st->colored, NULL);
+	return NULL;
+}
+
+/* Write out every colored batch and give it back to the reader. */
+void* write_batches(void* arg) {
+	stages* st = arg;
+	batch* b = NULL;
+	unsigned long spent[PHASES];
+	unsigned long* stamps = NULL;
+	unsigned long flushed = 0;
+	int i = 0;
+
+	while ((b = ring_pop(st->colored)) != NULL) {
+		fwrite(b->out->data, 1, b->out->size, stdout);
+		fflush(stdout);
+
+		if (st->timed) {
+			flushed = stats_clock();
+			for (i = 0; i < b->count; i++) {
+				stamps = b->stamps + i * STAMPS;
+				spent[PHASE_INPUT] = stamps[STAMP_WAIT];
+				spent[PHASE_MATCH] = stamps[STAMP_MATCHED] - stamps[STAMP_READ];
+				spent[PHASE_RENDER] = stamps[STAMP_RENDERED] - stamps[STAMP_MATCHED];
+				spent[PHASE_OUTPUT] = flushed - stamps[STAMP_RENDERED];
+				stats_line(spent);
+			}
+		}
+
+		ring_push(st->empty, b);
+	}
+
+	return NULL;
+}
+
+/*
+ * Color opt->file like scanline() does, but with reading, matching and
+ * writing each on its own thread, so waiting for input or output
+ * overlaps with running the patterns.
+ *
+ * Up to opt->depth batches of lines queue up between two stages.
+ * With -s, the match phase of a line also covers the time it waited
+ * for the matcher and the output phase the time it waited for the writer.
+ */
+int pipeline(options* opt) {
+	stages st;
+	pthread_t matcher;
+	pthread_t writer;
+	int batches = opt->depth * 2 + 3;
+	int i;
+
+	st.opt = opt;
+	st.timed = stats_enabled();
+	st.full = ring_new(opt->depth);
+	st.colored = ring_new(opt->depth);
+	st.empty = ring_new(batches);
+
+	for (i = 0; i < batches; i++) {
+		ring_push(st.empty, batch_new(st.timed));
+	}
+
+	pthread_create(&matcher, NULL, match_batches, &st);
+	pthread_create(&writer, NULL, write_batches, &st);
+
+	read_batches(&st, fileno(opt->file));
+
+	pthread_join(matcher, NULL);
+	pthread_join(writer, NULL);
+
+	return 0;
+}
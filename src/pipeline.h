@@ -0,0 +1,46 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "options.h"
+#include "scanner.h"
+#include "ring.h"
+
+/* Most lines a batch carries from one stage to the next. */
+#define BATCH_LINES 256
+
+/* How many bytes the reader asks for at once. */
+#define READ_SIZE 65536
+
+/* A run of lines going through the pipeline together. */
+typedef struct {
+	char* data;               /* the lines, back to back */
+	int size;
+	int capacity;
+	int ends[BATCH_LINES];    /* where each line ends in data */
+	int count;
+	o_buffer* out;            /* the colored lines */
+	unsigned long* stamps;    /* STAMPS timestamps per line, with -s only */
+} batch;
+
+/*
+ * What each line carries through the pipeline with -s: how long the
+ * reader waited for it and when it was read, matched and rendered.
+ */
+#define STAMP_WAIT     0
+#define STAMP_READ     1
+#define STAMP_MATCHED  2
+#define STAMP_RENDERED 3
+#define STAMPS         4
+
+/* Everything the stages share. */
+typedef struct {
+	options* opt;
+	ring* full;    /* batches read, from the reader to the matcher */
+	ring* colored; /* batches colored, from the matcher to the writer */
+	ring* empty;   /* batches written, back to the reader */
+	int timed;
+} stages;
+
+extern int pipeline(options* opt);
+
+#endif /* PIPELINE_H */
@@ -0,0 +1,85 @@
+#define _XOPEN_SOURCE 600
+
+#include "ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* How many times to retry before going to sleep. */
+#define RING_SPINS 256
+
+/* Allocate and return a new empty ring holding up to capacity elements. */
+ring* ring_new(int capacity) {
+	ring* r = malloc(sizeof(ring));
+	memset(r, 0, sizeof(ring));
+	r->capacity = capacity;
+	r->slots = malloc(sizeof(void*) * capacity);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->wakeup, NULL);
+	return r;
+}
+
+/* Return how many elements are queued in r. */
+int ring_length(ring* r) {
+	return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Wait until r has at least one element (full == 0)
+ * or at least one free slot (full == 1).
+ */
+void ring_wait(ring* r, int full) {
+	int i;
+
+	for (i = 0; i < RING_SPINS; i++) {
+		if ((unsigned long) ring_length(r) != (full ? r->capacity : 0)) {
+			return;
+		}
+		sched_yield();
+	}
+
+	/*
+	 * Announce we are going to sleep before checking again, so the other
+	 * side either sees us waiting or we see what it has just done.
+	 */
+	pthread_mutex_lock(&r->lock);
+	__atomic_add_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+	while ((unsigned long) ring_length(r) == (full ? r->capacity : 0)) {
+		pthread_cond_wait(&r->wakeup, &r->lock);
+	}
+	__atomic_sub_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Wake up the other side if it is sleeping. */
+void ring_notify(ring* r) {
+	if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_broadcast(&r->wakeup);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+/* Append e to r, waiting for a free slot if it is full. */
+void ring_push(ring* r, void* e) {
+	unsigned long tail = r->tail;
+
+	ring_wait(r, 1);
+	r->slots[tail % r->capacity] = e;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+	ring_notify(r);
+}
+
+/* Remove and return the oldest element of r, waiting for one if it is empty. */
+void* ring_pop(ring* r) {
+	unsigned long head = r->head;
+	void* e = NULL;
+
+	ring_wait(r, 0);
+	e = r->slots[head % r->capacity];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+	ring_notify(r);
+	return e;
+}
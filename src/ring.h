@@ -0,0 +1,28 @@
+#ifndef RING_H
+#define RING_H
+
+#include <pthread.h>
+
+/*
+ * Bounded single-producer/single-consumer queue of pointers.
+ *
+ * Pushing and popping never take a lock while the queue is neither full
+ * nor empty. A side that has to wait spins for a while and then sleeps
+ * on a condition variable, so idle pipelines don't burn a CPU.
+ */
+typedef struct {
+	void** slots;
+	unsigned long capacity;
+	unsigned long head;   /* next slot to pop, only written by the consumer */
+	unsigned long tail;   /* next slot to push, only written by the producer */
+	int waiting;          /* sides sleeping on wakeup */
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+} ring;
+
+extern ring* ring_new(int capacity);
+extern void ring_push(ring* r, void* e);
+extern void* ring_pop(ring* r);
+extern int ring_length(ring* r);
+
+#endif /* RING_H */
@@ -2,11 +2,21 @@
 #include "scanner.h"
 #include "colors.h"
 #include "list.h"
+#include "stats.h"
+#include "cache.h"
+#include "utf8.h"
+#include "ansi.h"
 
 #include <pcre.h>
 #include <stdio.h>
 #include <string.h>
 
+/* How many callouts go by between two reads of the clock. */
+#define DEADLINE_CALLS 64
+
+/* Most bytes of escape sequences remembered as the colors of the input. */
+#define COLOR_STATE_MAX 256
+
 /*
  * Print size bytes from buffer with colored output.
  * color can't be NULL.
@@ -79,41 +89,133 @@ int nextline(FILE* file, char** buffer) {
 
 /*
  * Just a wrapper to pcre_exec.
+ * flags are passed on to pcre_exec along with PCRE_NOTEMPTY.
+ * ovector[0] is < 0 if there was no match.
+ *
+ * Running out of the match limits set in extra, or of time, is not an
+ * error, it is returned like PCRE does so the caller can decide what to do.
  */
-int* match(pcre* code, char* subject, int length, int startoffset, int ovecsize) {
+int match(pcre* code, pcre_extra* extra, char* subject, int length, int startoffset, int flags, int* ovector, int ovecsize) {
 	int r = 0;
-	pcre_extra* extra = NULL;
-	int options = PCRE_NOTEMPTY;
-	int *ovector = malloc(sizeof(int) * ovecsize);
+	int options = PCRE_NOTEMPTY | flags;
 	memset(ovector, 0, sizeof(int) * ovecsize);
 
 	r = pcre_exec(code, extra, subject, length, startoffset, options, ovector, ovecsize);
 
 	/* If there is actually an error, we should stop execution. */
-	if (r < -1) {
+	if (r < -1 && r != PCRE_ERROR_MATCHLIMIT && r != PCRE_ERROR_RECURSIONLIMIT && r != PCRE_ERROR_CALLOUT) {
 		printf("PCRE error: %d\n", r);
 		exit(1);
 	}
 
-	return ovector;
+	if (r < 0) {
+		ovector[0] = -1;
+	}
+
+	return r;
+}
+
+/*
+ * PCRE callout for patterns compiled with PCRE_AUTO_CALLOUT, which PCRE
+ * calls before every item it matches. The callout data is the deadline
+ * of the line, and once it is past the match is abandoned with
+ * PCRE_ERROR_CALLOUT. The clock is only read every DEADLINE_CALLS calls.
+ */
+int past_deadline(pcre_callout_block* block) {
+	deadline* d = block->callout_data;
+
+	if (d == NULL || d->calls++ % DEADLINE_CALLS != 0) {
+		return 0;
+	}
+
+	return stats_clock() > d->at ? PCRE_ERROR_CALLOUT : 0;
+}
+
+/*
+ * Return how many ints the ovector of code needs to hold
+ * the whole match and every capture group.
+ */
+int ovector_size(pcre* code) {
+	int groups = 0;
+	pcre_fullinfo(code, NULL, PCRE_INFO_CAPTURECOUNT, &groups);
+	return (groups + 1) * 3;
+}
+
+/*
+ * Claim the bytes covered by m in taken, unless some of them were
+ * already claimed by an earlier match, in which case m loses.
+ * Returns how many bytes were claimed.
+ *
+ * Patterns are resolved in order of declaration, so this is what gives
+ * first matches priority and discards nested or overlapping ones.
+ */
+int claim(char* taken, o_match* m) {
+	int i;
+
+	for (i = m->start; i < m->end; i++) {
+		if (taken[i]) {
+			return 0;
+		}
+	}
+
+	memset(taken + m->start, 1, m->end - m->start);
+	return m->end - m->start;
+}
+
+/* Allocate and return a new empty output buffer. */
+o_buffer* o_buffer_new() {
+	o_buffer* out = malloc(sizeof(o_buffer));
+	out->capacity = 256;
+	out->size = 0;
+	out->data = malloc(out->capacity);
+	return out;
+}
+
+/* Append size bytes from data to out, growing it as needed. */
+void o_buffer_append(o_buffer* out, char* data, int size) {
+	char* tmp = NULL;
+
+	if (out->size + size > out->capacity) {
+		while (out->size + size > out->capacity) {
+			out->capacity *= 2;
+		}
+		tmp = malloc(out->capacity);
+		memcpy(tmp, out->data, out->size);
+		free(out->data);
+		out->data = tmp;
+	}
+
+	memcpy(out->data + out->size, data, size);
+	out->size += size;
+}
+
+/* Append the \0 terminated string to out. */
+void o_buffer_puts(o_buffer* out, char* string) {
+	o_buffer_append(out, string, strlen(string));
+}
+
+/* Append what turns c on to out. */
+void o_buffer_color(o_buffer* out, color* c) {
+	o_buffer_puts(out, c->foreground);
+	if (c->background != NULL) {
+		o_buffer_puts(out, c->background);
+	}
 }
 
 /*
- * Print buffer considering the list of matches.
+ * Render len bytes of buffer into out considering the list of matches.
+ * Matches can't overlap, see claim().
  */
-void print_colored_buffer(char* buffer, list* matches) {
-	int bufferlen = strlen(buffer);
-	char** start;
-	char** end;
+void render_colored_buffer(o_buffer* out, char* buffer, int len, list* matches) {
+	color** start;
+	char* end;
 	o_match* m = NULL;
 	list_node* n = NULL;
-	int len = 0;
-	int c = 0;
+	int from = 0;
 	int i = 0;
-	int j = 0;
 
 	/*
-	 * Allocate two arrays of colors in the format (index) => (color)
+	 * Allocate two arrays in the format (index) => (color)
 	 * so we can lookup it at every character while traversing the buffer
 	 * to check if there is some color to be output at that index.
 	 *
@@ -123,134 +225,628 @@ void print_colored_buffer(char* buffer, list* matches) {
 	 *
 	 * Remember: premature optimization is the root of all evils.
 	 */
-	start = malloc(sizeof(char*) * (bufferlen + 1));
-	end = malloc(sizeof(char*) * (bufferlen + 1));
-	memset(start, 0, sizeof(char*) * (bufferlen + 1));
-	memset(end, 0, sizeof(char*) * (bufferlen + 1));
+	start = malloc(sizeof(color*) * (len + 1));
+	end = malloc(len + 1);
+	memset(start, 0, sizeof(color*) * (len + 1));
+	memset(end, 0, len + 1);
 
 	/* Build the colors array. */
 	n = matches->head;
 	while ((n = n->next) != NULL) {
 		m = n->element;
+		start[m->start] = m->color;
+		end[m->end] = 1;
+	}
 
-		/* Keep the first match and discard the later. */
-		if (start[m->start] != NULL || end[m->end] != NULL) {
+	/*
+	 * Loop through the buffer while checking the colored array,
+	 * copying the text between two color changes at once.
+	 */
+	for (i = 0; i <= len; i++) {
+		if (!end[i] && start[i] == NULL) {
 			continue;
 		}
 
-		/* Do not allow nested matches. */
-		for (j = m->start + 1; j < m->end; j++) {
-			if (start[j] != NULL || end[j] != NULL) {
-				break;
-			}
-		}
+		o_buffer_append(out, buffer + from, i - from);
+		from = i;
 
-		if (j != m->end) {
-			continue;
+		if (end[i]) {
+			o_buffer_puts(out, COLOR_RESET);
 		}
 
-		len = strlen(m->color->foreground);
-		if (m->color->background != NULL) {
-			len += strlen(m->color->background);
+		if (start[i] != NULL) {
+			o_buffer_color(out, start[i]);
 		}
+	}
+	o_buffer_append(out, buffer + from, len - from);
+
+	free(start);
+	free(end);
+}
 
-		start[m->start] = malloc(len + 1);
-		memset(start[m->start], 0, len + 1);
-		strcat(start[m->start], m->color->foreground);
-		if (m->color->background != NULL) {
-			strcat(start[m->start], m->color->background);
+/*
+ * Go through the escape sequences in the size bytes at buffer, keeping
+ * in state those that set the colors since the last reset.
+ * Returns 1 if any of them changed the colors.
+ *
+ * Input that keeps setting colors without ever resetting them would make
+ * state grow forever, so past COLOR_STATE_MAX it starts over from the
+ * last sequence.
+ */
+int track_colors(o_buffer* state, char* buffer, int size) {
+	int recolor = 0;
+	int length = 0;
+	int k = 0;
+
+	k = ansi_find(buffer, size);
+	while (k < size) {
+		length = ansi_length(buffer + k, size - k);
+		switch (ansi_sgr(buffer + k, length)) {
+			case SGR_RESET:
+				state->size = 0;
+				recolor = 1;
+				/* Nothing to keep if it only resets them. */
+				if ((int) strspn(buffer + k + 2, "0;") == length - 3) {
+					break;
+				}
+				/* Fall through. */
+			case SGR_SET:
+				if (state->size + length > COLOR_STATE_MAX) {
+					state->size = 0;
+				}
+				o_buffer_append(state, buffer + k, length);
+				recolor = 1;
+				break;
 		}
 
-		end[m->end] = malloc(strlen(COLOR_RESET) + 1);
-		strcpy(end[m->end], COLOR_RESET);
+		k += length;
+		k += ansi_find(buffer + k, size - k);
 	}
 
-	/* Loop through the buffer while checking the colored array. */
-	while ((c = *buffer++) != '\0') {
-		if (end[i] != NULL) {
-			fputs(end[i], stdout);
+	return recolor;
+}
+
+/*
+ * Like render_colored_buffer(), but for a line that had its escape
+ * sequences stripped before matching: len is how many of its visible
+ * bytes were matched, and visible byte i is buffer[map[i]].
+ *
+ * The escape sequences are written out where they were. Those changing
+ * colors are kept in state, see track_colors(), so once a match is over
+ * the colors of the input can be set back, and one inside a match is
+ * followed by the color of the match again so it stays visible.
+ * state comes in with the colors earlier lines left set, since they
+ * carry over from one line to the next.
+ */
+void render_merged_buffer(o_buffer* out, char* buffer, int* map, int len, list* matches, o_buffer* state) {
+	color** start;
+	char* end;
+	color* current = NULL;
+	o_match* m = NULL;
+	list_node* n = NULL;
+	int recolor = 0;
+	int from = 0;
+	int gap = 0;
+	int at = 0;
+	int i = 0;
+
+	start = malloc(sizeof(color*) * (len + 1));
+	end = malloc(len + 1);
+	memset(start, 0, sizeof(color*) * (len + 1));
+	memset(end, 0, len + 1);
+
+	n = matches->head;
+	while ((n = n->next) != NULL) {
+		m = n->element;
+		start[m->start] = m->color;
+		end[m->end] = 1;
+	}
+
+	for (i = 0; i <= len; i++) {
+		/* Escape sequences before visible byte i are in buffer[gap, at). */
+		at = map[i];
+		gap = i > 0 ? map[i - 1] + 1 : 0;
+		if (!end[i] && start[i] == NULL && gap == at) {
+			continue;
 		}
 
-		if (start[i] != NULL) {
-			fputs(start[i], stdout);
+		o_buffer_append(out, buffer + from, gap - from);
+		from = at;
+
+		if (end[i]) {
+			o_buffer_puts(out, COLOR_RESET);
+			o_buffer_append(out, state->data, state->size);
+			current = NULL;
 		}
 
-		i++;
-		fputc(c, stdout);
+		recolor = track_colors(state, buffer + gap, at - gap);
+		o_buffer_append(out, buffer + gap, at - gap);
+
+		if (start[i] != NULL) {
+			current = start[i];
+		}
+		if (current != NULL && (start[i] != NULL || recolor)) {
+			o_buffer_color(out, current);
+		}
 	}
+	o_buffer_append(out, buffer + from, map[len] - from);
 
-	/* The last index has to run outside the loop */
-	if (end[i] != NULL) {
-		fputs(end[i], stdout);
+	free(start);
+	free(end);
+}
+
+/*
+ * Find where each of the first count fields of the len bytes of buffer
+ * start and end, fields being separated by delimiter and the trailing
+ * newline not being part of the last one. starts[i] and ends[i] are set
+ * for field i + 1, or to -1 if the line has less fields than that.
+ */
+void split_fields(char* buffer, int len, char delimiter, int count, int* starts, int* ends) {
+	char* p = buffer;
+	char* end = buffer + len;
+	char* d = NULL;
+	int i;
+
+	if (len > 0 && buffer[len - 1] == '\n') {
+		end--;
 	}
-	if (start[i] != NULL) {
-		fputs(start[i], stdout);
+
+	for (i = 0; i < count; i++) {
+		if (p > end) {
+			starts[i] = -1;
+			ends[i] = -1;
+			continue;
+		}
+
+		d = memchr(p, delimiter, end - p);
+		if (d == NULL) {
+			d = end;
+		}
+
+		starts[i] = p - buffer;
+		ends[i] = d - buffer;
+		p = d + 1;
 	}
 }
 
 /*
- * Scan through file line by line executing every pattern
- * individually as many times as needed each line.
+ * Run every pattern over the len bytes of buffer, as many times as
+ * needed, and return the list of matches to be colored.
+ *
+ * If utf8 is set, buffer is known to be valid UTF-8 and the patterns
+ * compiled for UTF-8 are used without having PCRE check it again.
+ *
+ * Patterns that color their capture groups add one match per group
+ * instead of one for the whole match.
+ *
+ * Patterns run in order of declaration and each match claims the bytes
+ * it colors. Once every byte of the line but its trailing newline is
+ * claimed the remaining patterns could not color anything visible,
+ * so they are skipped.
+ *
+ * If a pattern runs out of its match limits, or the patterns together
+ * take longer than the time budget, the line is left uncolored and
+ * gave_up is set. The budget is enforced from inside pcre_exec, see
+ * past_deadline(), so a runaway pattern is stopped once it is spent.
+ *
+ * Patterns bound to a field only see that field, as if it were the whole
+ * line, and are not run at all on lines that don't have it.
+ *
+ * If cut is set, the line goes on past len bytes, so $ can't match there.
+ *
+ * absent, which may be NULL, tells which patterns scanblock() already
+ * found can't match the line, so they are not run.
  */
-int scanline(FILE* file, list* patterns, color** colors) {
-	int i = 0;
-	char* buffer = NULL;
-	int ovecsize = patterns->length * 3 + 3;
+list* matchline(char* buffer, unsigned int len, options* opt, int utf8, int cut, char* absent, int* gave_up) {
+	int j = -1;
+	int g = 0;
 	int* ovector = NULL;
-	list_node* n = NULL;
-	list* matches = NULL;
+	list_node* n = opt->patterns->head;
+	list* matches = list_new();
 	o_match* m = NULL;
 	int adv = 0;
-	unsigned int len = 0;
+	int base = 0;
+	int size = len;
+	int* starts = NULL;
+	int* ends = NULL;
+	int visible = len > 0 && buffer[len - 1] == '\n' ? len - 1 : len;
+	unsigned int unclaimed = visible;
+	char* taken = malloc(len + 1);
 	pattern* p = NULL;
-	ovecsize = 30;
+	int hit = 0;
+	int r = 0;
+	int flags = 0;
+	int timed = stats_enabled();
+	unsigned long t = 0;
+	deadline timer;
+	pcre_extra extra;
+
+	*gave_up = 0;
+	memset(taken, 0, len + 1);
+	if (opt->budget > 0) {
+		timer.at = stats_clock() + opt->budget;
+		timer.calls = 0;
+	}
 
-	/* Read the file line by line. */
-	while ((nextline(file, &buffer)) != EOF) {
-		n = patterns->head;
-		i = 0;
-		matches = list_new();
-		len = strlen(buffer);
+	/* Split the line only once and only as far as some pattern needs. */
+	if (opt->fields > 0) {
+		starts = malloc(sizeof(int) * opt->fields);
+		ends = malloc(sizeof(int) * opt->fields);
+		split_fields(buffer, len, opt->delimiter, opt->fields, starts, ends);
+	}
+
+	/* Try to match every pattern with this line. */
+	while ((n = n->next) != NULL) {
+		adv = 0;
+		hit = 0;
+		p = n->element;
+		j++;
+
+		/* Nothing left to color, the rest can't match anything visible. */
+		if (unclaimed == 0) {
+			__atomic_add_fetch(&p->skips, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		base = 0;
+		size = len;
+		if (p->field > 0) {
+			if (starts[p->field - 1] < 0) {
+				continue;
+			}
+			base = starts[p->field - 1];
+			size = ends[p->field - 1] - base;
+		}
+
+		flags = utf8 ? PCRE_NO_UTF8_CHECK : 0;
+		if (cut && base + size == (int) len) {
+			flags |= PCRE_NOTEOL;
+		}
 
-		/* Try to match every pattern with this line. */
-		while ((n = n->next) != NULL) {
-			adv = 0;
-			p = n->element;
+		if (absent != NULL && absent[j]) {
+			continue;
+		}
+		__atomic_add_fetch(&p->lines, 1, __ATOMIC_RELAXED);
+
+		/* Every pattern shares the limits, but the deadline is this line's. */
+		if (opt->budget > 0) {
+			extra = *p->extra;
+			extra.callout_data = &timer;
+		}
+
+		ovector = malloc(sizeof(int) * p->ovecsize);
+		if (timed) {
+			t = stats_clock();
+		}
+
+		/*
+		 * Try to match the same pattern as many times as possible.
+		 * PCRE will only match one time, so we need to loop through
+		 * the string in order to match every possibility.
+		 */
+		while (1) {
+			r = match(utf8 ? p->utf8_code : p->code, opt->budget > 0 ? &extra : p->extra, buffer + base, size, adv, flags, ovector, p->ovecsize);
+
+			if (r == PCRE_ERROR_MATCHLIMIT || r == PCRE_ERROR_RECURSIONLIMIT) {
+				__atomic_add_fetch(&p->limits, 1, __ATOMIC_RELAXED);
+				*gave_up = 1;
+				break;
+			}
+
+			if (r == PCRE_ERROR_CALLOUT) {
+				__atomic_add_fetch(&p->timeouts, 1, __ATOMIC_RELAXED);
+				*gave_up = 1;
+				break;
+			}
+
+			if (ovector[0] < 0) {
+				break;
+			}
+			adv = ovector[1];
 
 			/*
-			 * Try to match the same pattern as many times as possible.
-			 * PCRE will only match one time, so we need to loop through
-			 * the string in order to match every possibility.
+			 * Add the whole match, or every group that took part in it,
+			 * to the list of matches. Groups are colored from the first
+			 * to the last and each has to claim its own bytes.
 			 */
-			while (adv >= 0) {
-				ovector = match(p->code, buffer, len, adv, ovecsize);
-
-				/* If the pattern matches, add the match to a list of matches. */
-				if (ovector[0] >= 0) {
-					m = malloc(sizeof(o_match));
-					m->start = ovector[0];
-					m->end = ovector[1];
-					m->color = colors[i];
-					m->string = p->string;
+			for (g = p->groups > 0 ? 1 : 0; g <= p->groups; g++) {
+				if (ovector[g*2] < 0 || ovector[g*2] == ovector[g*2+1]) {
+					continue;
+				}
+
+				m = malloc(sizeof(o_match));
+				m->start = base + ovector[g*2];
+				m->end = base + ovector[g*2+1];
+				m->color = opt->colors[p->color + (g > 0 ? g - 1 : 0)];
+				m->string = p->string;
+
+				if (claim(taken, m) > 0) {
+					if (m->start < visible) {
+						unclaimed -= (m->end < visible ? m->end : visible) - m->start;
+					}
 					list_add(matches, m);
-					adv = ovector[1];
+					hit = 1;
 				} else {
-					adv = -1;
+					free(m);
 				}
-
-				free(ovector);
 			}
-			i++;
 		}
 
-		if (matches->length < 1) {
-			fputs(buffer, stdout);
+		free(ovector);
+		__atomic_add_fetch(&p->hits, hit, __ATOMIC_RELAXED);
+		if (timed) {
+			__atomic_add_fetch(&p->time, stats_clock() - t, __ATOMIC_RELAXED);
+		}
+
+		if (*gave_up) {
+			break;
+		}
+	}
+
+	free(taken);
+	free(starts);
+	free(ends);
+
+	if (*gave_up) {
+		list_free(matches);
+		matches = list_new();
+	}
+
+	return matches;
+}
+
+/*
+ * Append the colored version of the len bytes of buffer to out.
+ *
+ * When there is a cache, lines seen before are copied straight from it
+ * without running any pattern.
+ *
+ * In UTF-8 mode, lines that are not valid UTF-8 are matched byte by byte.
+ * valid tells the line was already checked, so it isn't done twice.
+ *
+ * With a scan window, patterns only look at the first opt->window bytes
+ * of the line, backing off to a character boundary in UTF-8 mode,
+ * and the rest is copied as is. Neither the cache nor -a look past the
+ * window either, so the cost of a line barely grows with its length:
+ * past it -a only looks for escape sequences that change the colors.
+ *
+ * Lines the patterns gave up on are not cached, so they get another
+ * chance when they come again.
+ *
+ * With -a, escape sequences already in the line are left out of what
+ * the patterns see and merged back into the output. state holds the
+ * colors the input has set so far, see track_colors(), and is NULL
+ * without -a. Lines that start with colors set are neither taken from
+ * the cache nor put in it, since their output depends on them.
+ *
+ * absent is passed on to matchline().
+ *
+ * If matched is not NULL, it is set to the time matching finished.
+ */
+void colorline(o_buffer* out, char* buffer, unsigned int len, options* opt, int valid, char* absent, o_buffer* state, unsigned long* matched) {
+	list* matches = NULL;
+	cache_entry* e = NULL;
+	cache* cache = state == NULL || state->size == 0 ? opt->cache : NULL;
+	int from = out->size;
+	char* text = buffer;
+	int* map = NULL;
+	unsigned int limit = len;
+	unsigned int size = len;
+	unsigned int scanned = len;
+	unsigned int head = len;
+	int gave_up = 0;
+
+	/* One byte past the window tells whether the line goes on. */
+	if (opt->window > 0 && len > opt->window) {
+		limit = opt->window + 1;
+	}
+	size = limit;
+
+	if (state != NULL && (state->size > 0 || ansi_find(buffer, limit) < (int) limit)) {
+		text = malloc(limit);
+		map = malloc(sizeof(int) * (limit + 1));
+		size = ansi_strip(buffer, len, text, map, limit);
+	}
+
+	/* A line that fits in the window but for its newline is not cut. */
+	scanned = size;
+	if (opt->window > 0 && size > opt->window && text[opt->window] != '\n') {
+		scanned = opt->window;
+		while (opt->utf8 && scanned > 0 && (text[scanned] & 0xc0) == 0x80) {
+			scanned--;
+		}
+	}
+	head = map != NULL ? (unsigned int) map[scanned] : scanned;
+
+	if (cache != NULL) {
+		e = cache_get(cache, buffer, head, len - head);
+	}
+
+	if (e != NULL) {
+		o_buffer_append(out, e->value, e->value_size);
+	} else {
+		matches = matchline(text, scanned, opt,
+			opt->utf8 && (valid || utf8_valid(text, scanned)), scanned < size, absent, &gave_up);
+	}
+
+	if (matched != NULL) {
+		*matched = stats_clock();
+	}
+
+	if (matches != NULL) {
+		if (map != NULL) {
+			render_merged_buffer(out, buffer, map, scanned, matches, state);
 		} else {
-			print_colored_buffer(buffer, matches);
+			render_colored_buffer(out, buffer, scanned, matches);
+		}
+		if (cache != NULL && !gave_up) {
+			cache_put(cache, buffer, head, len - head, out->data + from, out->size - from);
 		}
+		list_free(matches);
+	} else if (state != NULL) {
+		track_colors(state, buffer, head);
+	}
+	o_buffer_append(out, buffer + head, len - head);
+	if (state != NULL) {
+		track_colors(state, buffer + head, len - head);
+	}
 
-		free(matches);
+	if (map != NULL) {
+		free(text);
+		free(map);
+	}
+}
+
+/*
+ * Run every pattern over the count lines of a block at once, line i
+ * ending at ends[i] in data, and return which patterns can't match which
+ * lines: pattern j can't match line i if absent[i * patterns + j] is set.
+ * The caller frees the result.
+ *
+ * A single pcre_exec finds the first line the pattern may match, then
+ * the scan goes on from the next line, so lines where it finds nothing
+ * cost nothing on their own. Lines it may match still run it on their
+ * own, since that is what decides what gets colored, so a match that
+ * spans lines only costs a line that runs the pattern for nothing.
+ *
+ * valid tells the whole block is valid UTF-8. If it isn't, lines may be
+ * matched either way, so in UTF-8 mode nothing is ruled out. Neither is
+ * anything on lines with escape sequences with -a, since the patterns
+ * only see what is between them, nor on lines cut by the scan window,
+ * since the end of the window is the end of their subject and \b can
+ * match there.
+ *
+ * Patterns bound to a field see it as their whole subject, so ^ or \b
+ * can match at its start, and they are never run over the block.
+ *
+ * With a time budget, each pcre_exec over the block gets as long as a
+ * line would. Running out of it, like running out of the match limits,
+ * leaves the lines from there on to run the pattern on their own.
+ */
+char* scanblock(char* data, int* ends, int count, options* opt, int valid) {
+	int patterns = opt->patterns->length;
+	char* absent = malloc(count * patterns);
+	int size = count > 0 ? ends[count - 1] : 0;
+	int ovector[3];
+	list_node* n = opt->patterns->head;
+	pattern* p = NULL;
+	pcre* code = NULL;
+	int line = 0;
+	int from = 0;
+	int r = 0;
+	int j = 0;
+	int timed = stats_enabled();
+	unsigned long t = 0;
+	deadline timer;
+	pcre_extra extra;
+
+	memset(absent, 0, count * patterns);
+
+	for (j = 0; (n = n->next) != NULL; j++) {
+		p = n->element;
+		code = opt->utf8 ? p->block_utf8_code : p->block_code;
+		if (code == NULL || p->field > 0 || (opt->utf8 && !valid)) {
+			continue;
+		}
+
+		if (timed) {
+			t = stats_clock();
+		}
+
+		if (opt->budget > 0) {
+			extra = *p->extra;
+			extra.callout_data = &timer;
+		}
+
+		line = 0;
+		from = 0;
+		while (line < count) {
+			if (opt->budget > 0) {
+				timer.at = stats_clock() + opt->budget;
+				timer.calls = 0;
+			}
+
+			r = match(code, opt->budget > 0 ? &extra : p->extra, data, size, from, opt->utf8 ? PCRE_NO_UTF8_CHECK : 0, ovector, 3);
+
+			/* Lines from here on are left to run the pattern on their own. */
+			if (r == PCRE_ERROR_MATCHLIMIT || r == PCRE_ERROR_RECURSIONLIMIT || r == PCRE_ERROR_CALLOUT) {
+				break;
+			}
+
+			/* Every line before the one the match starts in has none. */
+			while (line < count && (ovector[0] < 0 || ovector[0] >= ends[line])) {
+				absent[line * patterns + j] = 1;
+				line++;
+			}
+
+			if (line < count) {
+				from = ends[line++];
+			}
+		}
+
+		if (timed) {
+			__atomic_add_fetch(&p->time, stats_clock() - t, __ATOMIC_RELAXED);
+		}
+	}
+
+	for (line = 0, from = 0; line < count; from = ends[line++]) {
+		if ((opt->window > 0 && (unsigned int) (ends[line] - from - (data[ends[line] - 1] == '\n')) > opt->window) ||
+			(opt->ansi && ansi_find(data + from, ends[line] - from) < ends[line] - from)) {
+			memset(absent + line * patterns, 0, patterns);
+		}
+	}
+
+	return absent;
+}
+
+/*
+ * Scan through file line by line, coloring every line with colorline()
+ * and writing it out.
+ */
+int scanline(options* opt) {
+	char* buffer = NULL;
+	o_buffer* out = o_buffer_new();
+	int timed = stats_enabled();
+	unsigned long spent[PHASES];
+	unsigned long t = 0;
+	unsigned long matched = 0;
+	o_buffer* state = opt->ansi ? o_buffer_new() : NULL;
+
+	if (timed) {
+		t = stats_clock();
+	}
+
+	/* Read the file line by line. */
+	while ((nextline(opt->file, &buffer)) != EOF) {
+		/* After the last newline, nextline() gives an empty line before EOF. */
+		if (*buffer == '\0') {
+			free(buffer);
+			continue;
+		}
+
+		if (timed) {
+			spent[PHASE_INPUT] = stats_clock() - t;
+			t += spent[PHASE_INPUT];
+		}
+
+		out->size = 0;
+		colorline(out, buffer, strlen(buffer), opt, 0, NULL, state, timed ? &matched : NULL);
+		fwrite(out->data, 1, out->size, stdout);
 		free(buffer);
+
+		/*
+		 * When timing, flush every line so the output phase measures
+		 * how long the consumer keeps us blocked.
+		 */
+		if (timed) {
+			spent[PHASE_MATCH] = matched - t;
+			spent[PHASE_RENDER] = stats_clock() - matched;
+			t = matched + spent[PHASE_RENDER];
+			fflush(stdout);
+			spent[PHASE_OUTPUT] = stats_clock() - t;
+			t += spent[PHASE_OUTPUT];
+			stats_line(spent);
+		}
 	}
 
 	return 0;
@@ -261,30 +857,38 @@ int scanline(FILE* file, list* patterns, color** colors) {
  * every iteration.
  *
  * When pattern is found, print it out with the corresponding colors.
+ *
+ * If utf8 is set, string is valid UTF-8 and code was compiled for it,
+ * so string advances a whole character at a time.
+ *
+ * owners tells which pattern each group of code wraps, see concatenate().
  */
-int scanchar(char* string, int string_size, pcre* code, color** colors) {
+int scanchar(char* string, int string_size, pcre* code, int* owners, color** colors, int utf8) {
 	int i = 0;
+	int n = 0;
 	int length = string_size;
-	int ovecsize = 30;
-	int *ovector = NULL;
+	int ovecsize = ovector_size(code);
+	int *ovector = malloc(sizeof(int) * ovecsize);
 
 	do {
-		ovector = match(code, string, length, 0, ovecsize);
+		match(code, NULL, string, length, 0, utf8 ? PCRE_NO_UTF8_CHECK : 0, ovector, ovecsize);
 
 		if (ovector[0] != 0) {
-			fputc(*string++, stdout);
-			length--;
+			n = utf8 ? utf8_length(string, length) : 1;
+			fwrite(string, 1, n, stdout);
+			string += n;
+			length -= n;
 			continue;
 		}
 
 		/* Loop through the first 2/3 of the ovector. */
-		for (i = 2; i < ovecsize/3*2 - 2; i = i+2) {
+		for (i = 2; i < ovecsize/3*2; i = i+2) {
 			/*
 			 * pair (ovector[i], ovector[i+1]) is set to
 			 * (start, end) of the matching. It is < 0 in case of not matching.
 			 */
-			if (ovector[i] == 0) {
-				print_buffer(string, ovector[i+1], colors[i/2-1]);
+			if (ovector[i] == 0 && owners[i/2] >= 0) {
+				print_buffer(string, ovector[i+1], colors[owners[i/2]]);
 				break;
 			}
 		}
@@ -292,9 +896,8 @@ int scanchar(char* string, int string_size, pcre* code, color** colors) {
 		/* Increase the string pointer. */
 		string += ovector[1];
 		length -= ovector[1];
-
-		free(ovector);
 	} while(length > 0);
 
+	free(ovector);
 	return 0;
 }
@@ -3,6 +3,8 @@
 
 #include "list.h"
 #include "colors.h"
+#include "cache.h"
+#include "options.h"
 
 #include <stdio.h>
 #include <pcre.h>
@@ -21,7 +23,25 @@ typedef struct {
 	char* string;
 } o_match;
 
-extern int scanline(FILE* file, list* patterns, color** colors);
-extern int scanchar(char* string, int string_size, pcre* code, color** colors);
+/* Growable buffer lines are rendered into before being written out. */
+typedef struct {
+	char* data;
+	int size;
+	int capacity;
+} o_buffer;
+
+/* When matching a line has to be over by, see past_deadline(). */
+typedef struct {
+	unsigned long at;
+	unsigned int calls;
+} deadline;
+
+extern int past_deadline(pcre_callout_block* block);
+extern int ovector_size(pcre* code);
+extern o_buffer* o_buffer_new();
+extern void colorline(o_buffer* out, char* buffer, unsigned int len, options* opt, int valid, char* absent, o_buffer* state, unsigned long* matched);
+extern char* scanblock(char* data, int* ends, int count, options* opt, int valid);
+extern int scanline(options* opt);
+extern int scanchar(char* string, int string_size, pcre* code, int* owners, color** colors, int utf8);
 
 #endif /* SCANNER_H */
@@ -0,0 +1,287 @@
+#define _XOPEN_SOURCE 600
+
+#include "stats.h"
+#include "options.h"
+#include "list.h"
+#include "cache.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static char* PHASE_NAMES[PHASES] = {
+	"input", "match", "render", "output"
+};
+
+static int enabled = 0;
+static options* opt = NULL;
+static sigset_t usr1;
+
+/* Lines are accounted for and reported on from different threads. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Time from read to flush, i.e. how long a line waits inside color. */
+static histogram latency;
+/* Time spent in each phase. */
+static histogram phases[PHASES];
+/* End to end time of every line, bucketed by the phase that dominated it. */
+static histogram slowest[PHASES];
+
+/* Return the bucket a value falls into. */
+int hist_bucket(unsigned long value) {
+	int shift = 0;
+
+	if (value < HIST_SUB) {
+		return value;
+	}
+
+	while ((value >> shift) >= HIST_SUB) {
+		shift++;
+	}
+
+	return shift * (HIST_SUB / 2) + (value >> shift);
+}
+
+/* Return the highest value that would fall into bucket i. */
+unsigned long hist_top(int i) {
+	int shift = 0;
+
+	if (i < HIST_SUB) {
+		return i;
+	}
+
+	shift = i / (HIST_SUB / 2) - 1;
+	return (((unsigned long) (i - shift * (HIST_SUB / 2)) + 1) << shift) - 1;
+}
+
+/* Add value to h. */
+void hist_record(histogram* h, unsigned long value) {
+	h->counts[hist_bucket(value)]++;
+	h->count++;
+	if (value > h->max) {
+		h->max = value;
+	}
+}
+
+/* Return the value at quantile q (0 < q <= 1) of h. */
+unsigned long hist_quantile(histogram* h, double q) {
+	unsigned long seen = 0;
+	unsigned long wanted = q * h->count;
+	int i;
+
+	if (wanted < 1) {
+		wanted = 1;
+	}
+
+	for (i = 0; i < (int) HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= wanted) {
+			return hist_top(i) < h->max ? hist_top(i) : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+/* Return how many values of h are at least value. */
+unsigned long hist_above(histogram* h, unsigned long value) {
+	unsigned long n = 0;
+	int i;
+
+	for (i = hist_bucket(value); i < (int) HIST_BUCKETS; i++) {
+		n += h->counts[i];
+	}
+
+	return n;
+}
+
+/* Print the percentiles of h, converting nanoseconds to microseconds. */
+void hist_print(FILE* out, char* name, histogram* h) {
+	fprintf(out, "  %-8s p50 %10.1f  p99 %10.1f  p999 %10.1f  max %10.1f\n",
+		name,
+		hist_quantile(h, 0.5) / 1000.0,
+		hist_quantile(h, 0.99) / 1000.0,
+		hist_quantile(h, 0.999) / 1000.0,
+		h->max / 1000.0);
+}
+
+/*
+ * Print the report every time SIGUSR1 comes, from a thread of its own,
+ * so it doesn't have to wait for the next line to be read.
+ */
+void* report_on_signal(void* arg) {
+	int signum = 0;
+	(void) arg;
+
+	while (sigwait(&usr1, &signum) == 0) {
+		stats_report(stderr);
+	}
+
+	return NULL;
+}
+
+void report_at_exit() {
+	stats_report(stderr);
+}
+
+/*
+ * Start collecting statistics. They are printed out to stderr
+ * when the program exits or receives SIGUSR1.
+ */
+void stats_enable(options* o) {
+	pthread_t reporter;
+
+	/* Threads started from now on block it too, only the reporter takes it. */
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+	atexit(report_at_exit);
+	opt = o;
+	enabled = 1;
+
+	pthread_create(&reporter, NULL, report_on_signal, NULL);
+	pthread_detach(reporter);
+}
+
+int stats_enabled() {
+	return enabled;
+}
+
+/* Return a monotonic timestamp in nanoseconds. */
+unsigned long stats_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Account for one line given the nanoseconds it spent in each phase.
+ */
+void stats_line(unsigned long* spent) {
+	unsigned long total = 0;
+	int worst = 0;
+	int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < PHASES; i++) {
+		hist_record(&phases[i], spent[i]);
+		total += spent[i];
+		if (spent[i] > spent[worst]) {
+			worst = i;
+		}
+	}
+
+	hist_record(&latency, total - spent[PHASE_INPUT]);
+	hist_record(&slowest[worst], total);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Print how often each pattern ran, colored something or was skipped
+ * because earlier patterns had already colored the whole line,
+ * how often it made a line go uncolored by running out of match limits
+ * or time, and how much it cost per line it ran on.
+ *
+ * The matcher keeps counting while this runs, so the counters are
+ * read atomically, like they are updated.
+ */
+void stats_report_patterns(FILE* out) {
+	list_node* n = NULL;
+	pattern* p = NULL;
+	unsigned long lines = 0;
+	unsigned long hits = 0;
+	int i = 0;
+
+	if (opt->patterns == NULL) {
+		return;
+	}
+
+	fprintf(out, "  %-4s %10s %8s %10s %8s %8s %10s  %s\n",
+		"#", "lines", "hits", "skips", "limits", "timeouts", "usec/line", "pattern");
+
+	n = opt->patterns->head;
+	while ((n = n->next) != NULL) {
+		p = n->element;
+		lines = __atomic_load_n(&p->lines, __ATOMIC_RELAXED);
+		hits = __atomic_load_n(&p->hits, __ATOMIC_RELAXED);
+		fprintf(out, "  %-4d %10lu %7.1f%% %10lu %8lu %8lu %10.2f  %s\n",
+			++i,
+			lines,
+			lines > 0 ? 100.0 * hits / lines : 0.0,
+			__atomic_load_n(&p->skips, __ATOMIC_RELAXED),
+			__atomic_load_n(&p->limits, __ATOMIC_RELAXED),
+			__atomic_load_n(&p->timeouts, __ATOMIC_RELAXED),
+			lines > 0 ? __atomic_load_n(&p->time, __ATOMIC_RELAXED) / 1000.0 / lines : 0.0,
+			p->string);
+	}
+}
+
+/* Print how well the cache of repeated lines is doing, reading its counters atomically. */
+void stats_report_cache(FILE* out) {
+	cache* c = opt->cache;
+	unsigned long hits = 0;
+	unsigned long misses = 0;
+
+	if (c == NULL) {
+		return;
+	}
+
+	hits = __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+	misses = __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+	fprintf(out, "  cache: %lu hits, %lu misses (%.1f%% hit rate), %lu evictions, %d/%d lines\n",
+		hits,
+		misses,
+		hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+		__atomic_load_n(&c->evictions, __ATOMIC_RELAXED),
+		__atomic_load_n(&c->length, __ATOMIC_RELAXED),
+		c->capacity);
+}
+
+/*
+ * Print the latency histograms, in microseconds, and attribute the
+ * slowest 1% of the lines to the phase that took most of their time.
+ */
+void stats_report(FILE* out) {
+	histogram total;
+	unsigned long threshold = 0;
+	int i, j;
+
+	pthread_mutex_lock(&lock);
+	if (latency.count < 1) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < PHASES; i++) {
+		for (j = 0; j < (int) HIST_BUCKETS; j++) {
+			total.counts[j] += slowest[i].counts[j];
+		}
+		total.count += slowest[i].count;
+		if (slowest[i].max > total.max) {
+			total.max = slowest[i].max;
+		}
+	}
+	threshold = hist_quantile(&total, 0.99);
+
+	fprintf(out, "color: %lu lines, latency in usec\n", latency.count);
+	hist_print(out, "latency", &latency);
+	for (i = 0; i < PHASES; i++) {
+		hist_print(out, PHASE_NAMES[i], &phases[i]);
+	}
+
+	fprintf(out, "  slow lines (>= %.1f usec end to end) by phase:", threshold / 1000.0);
+	for (i = 0; i < PHASES; i++) {
+		fprintf(out, " %s %lu", PHASE_NAMES[i], hist_above(&slowest[i], threshold));
+	}
+	fputc('\n', out);
+
+	stats_report_patterns(out);
+	stats_report_cache(out);
+	fflush(out);
+	pthread_mutex_unlock(&lock);
+}
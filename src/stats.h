@@ -0,0 +1,36 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "options.h"
+
+#include <stdio.h>
+
+/* Phases a line goes through in line mode. */
+#define PHASE_INPUT  0
+#define PHASE_MATCH  1
+#define PHASE_RENDER 2
+#define PHASE_OUTPUT 3
+#define PHASES       4
+
+/*
+ * Log-linear histogram in the spirit of HdrHistogram: values below
+ * HIST_SUB are counted exactly, above that every power of two is split
+ * into HIST_SUB/2 buckets, which keeps the relative error around 6%.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (HIST_SUB / 2 * (sizeof(unsigned long) * 8 + 2))
+
+typedef struct {
+	unsigned long counts[HIST_BUCKETS];
+	unsigned long count;
+	unsigned long max;
+} histogram;
+
+extern void stats_enable(options* opt);
+extern int stats_enabled();
+extern unsigned long stats_clock();
+extern void stats_line(unsigned long* phases);
+extern void stats_report(FILE* out);
+
+#endif /* STATS_H */
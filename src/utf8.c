@@ -0,0 +1,82 @@
+#include "utf8.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Return the length of the UTF-8 sequence at the beginning of string,
+ * or 0 if it is not a valid one. Overlong forms, surrogates and code
+ * points past U+10FFFF are invalid, just like PCRE considers them.
+ */
+int utf8_length(char* string, int length) {
+	unsigned char* s = (unsigned char*) string;
+	int n = 0;
+	int i = 0;
+
+	if (length < 1) {
+		return 0;
+	}
+
+	if (s[0] < 0x80) {
+		return 1;
+	} else if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		n = 2;
+	} else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		n = 3;
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		n = 4;
+	} else {
+		return 0;
+	}
+
+	if (length < n) {
+		return 0;
+	}
+
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+	}
+
+	/* The second byte is further restricted for some leading bytes. */
+	if ((s[0] == 0xe0 && s[1] < 0xa0) ||
+		(s[0] == 0xed && s[1] > 0x9f) ||
+		(s[0] == 0xf0 && s[1] < 0x90) ||
+		(s[0] == 0xf4 && s[1] > 0x8f)) {
+		return 0;
+	}
+
+	return n;
+}
+
+/*
+ * Return 1 if the length bytes of string are valid UTF-8, 0 otherwise.
+ *
+ * Most text is ASCII, so with SSE2 runs of 16 ASCII bytes are skipped
+ * with a single compare and only the rest is decoded.
+ */
+int utf8_valid(char* string, int length) {
+	char* end = string + length;
+	int n = 0;
+
+	while (string < end) {
+#ifdef __SSE2__
+		while (end - string >= 16 && _mm_movemask_epi8(_mm_loadu_si128((__m128i*) string)) == 0) {
+			string += 16;
+		}
+
+		if (string == end) {
+			break;
+		}
+#endif
+		n = utf8_length(string, end - string);
+		if (n == 0) {
+			return 0;
+		}
+		string += n;
+	}
+
+	return 1;
+}
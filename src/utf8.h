@@ -0,0 +1,7 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+extern int utf8_valid(char* string, int length);
+extern int utf8_length(char* string, int length);
+
+#endif /* UTF8_H */